@@ -1,6 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <deque>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <variant>
+#include <vector>
 
 using std::cout;
 using std::endl;
@@ -55,27 +64,158 @@ class Entry {
   }
 };
 
+// Values larger than this are kept out of line in a ValueStore and nodes only
+// hold a compact handle to them, so splits, merges and the shifts inside
+// m_Entries move keys and handles instead of whole values
+constexpr size_t kMaxInlineValueSize = 2 * sizeof(void*);
+
+template <typename V>
+struct isValueStoredOutOfLine
+    : std::integral_constant<bool, (sizeof(V) > kMaxInlineValueSize)> {};
+
+template <typename V, bool OutOfLine = isValueStoredOutOfLine<V>::value>
+class ValueStore;
+
+// Small values are stored inline, the slot is the value itself
+template <typename V>
+class ValueStore<V, false> {
+ public:
+  using Slot = V;
+
+  Slot make(const V& value) { return value; }
+
+  V& resolve(Slot& slot) { return slot; }
+
+  const V& resolve(const Slot& slot) const { return slot; }
+
+  void release(const Slot&) {}
+};
+
+// Large values live in a slab, the slot is an index into it. A deque never
+// relocates its elements on growth, so a resolved value keeps its address
+// until the slot is released, no matter how the tree is restructured
+template <typename V>
+class ValueStore<V, true> {
+ private:
+  std::deque<V> m_Values;
+  std::vector<uint32_t> m_FreeSlots;
+
+ public:
+  using Slot = uint32_t;
+
+  Slot make(const V& value) {
+    if (m_FreeSlots.empty()) {
+      m_Values.push_back(value);
+      return m_Values.size() - 1;
+    }
+    Slot slot = m_FreeSlots.back();
+    m_FreeSlots.pop_back();
+    m_Values[slot] = value;
+    return slot;
+  }
+
+  V& resolve(Slot slot) { return m_Values[slot]; }
+
+  const V& resolve(Slot slot) const { return m_Values[slot]; }
+
+  void release(Slot slot) {
+    // Drop the value's own resources now, the slot is reused by later makes
+    m_Values[slot] = V();
+    m_FreeSlots.push_back(slot);
+  }
+};
+
+// Aggregates kept per subtree next to the entry count. A policy is a monoid
+// over values: identity(), lift(value) and an associative combine(a, b) that
+// is applied in key order
+template <typename V>
+struct NoAggregate {
+  using Type = std::monostate;
+
+  static Type identity() { return {}; }
+
+  static Type lift(const V&) { return {}; }
+
+  static Type combine(const Type&, const Type&) { return {}; }
+};
+
+template <typename V>
+struct SumAggregate {
+  using Type = V;
+
+  static Type identity() { return V(); }
+
+  static Type lift(const V& value) { return value; }
+
+  static Type combine(const Type& a, const Type& b) { return a + b; }
+};
+
+template <typename V>
+struct MinAggregate {
+  // The identity comes from numeric_limits, which gives V() for other types
+  static_assert(std::numeric_limits<V>::is_specialized,
+                "MinAggregate needs a value type with numeric_limits");
+
+  using Type = V;
+
+  static Type identity() { return std::numeric_limits<V>::max(); }
+
+  static Type lift(const V& value) { return value; }
+
+  static Type combine(const Type& a, const Type& b) { return std::min(a, b); }
+};
+
+template <typename V>
+struct MaxAggregate {
+  // The identity comes from numeric_limits, which gives V() for other types
+  static_assert(std::numeric_limits<V>::is_specialized,
+                "MaxAggregate needs a value type with numeric_limits");
+
+  using Type = V;
+
+  static Type identity() { return std::numeric_limits<V>::lowest(); }
+
+  static Type lift(const V& value) { return value; }
+
+  static Type combine(const Type& a, const Type& b) { return std::max(a, b); }
+};
+
 // The tree has order of t, where each node can have [t, 2t] m_Children and
 // [t-1, 2t-1] m_Keys (key-value pairs)
-template <typename K, typename V>
+template <typename K, typename V, typename Agg = NoAggregate<V>>
 class BTreeNode {
+ public:
+  using Slot = typename ValueStore<V>::Slot;
+
  private:
   int m_t;
   bool m_isLeaf;
-  std::vector<Entry<K, V>> m_Entries;
+  ValueStore<V>* m_Store;
+  std::vector<Entry<K, Slot>> m_Entries;
   std::vector<std::shared_ptr<BTreeNode>> m_Children;
 
+  // Number of entries and aggregate of values in the subtree rooted here,
+  // refreshed by updateAugment() whenever entries or children change
+  int m_Size;
+  typename Agg::Type m_Aggregate;
+
  public:
-  BTreeNode(int t, bool isLeaf);
+  BTreeNode(int t, bool isLeaf, ValueStore<V>* store);
 
   int nEntries() const;
 
   int nChildren() const;
 
-  void insertToNonFull(const K& key, const V& value);
+  void updateAugment();
+
+  void refreshAugment(const K& key);
+
+  void insertToNonFull(const K& key, const Slot& slot);
 
   void splitChild(int fullChildIdx);
 
+  Slot* getSlotPtr(const K& key);
+
   V* getValuePtr(const K& key);
 
   int getIdxForKey(const K& key) const;
@@ -86,9 +226,9 @@ class BTreeNode {
 
   void removeFromNonLeaf(int idx);
 
-  Entry<K, V> getPredEntry(int idx) const;
+  Entry<K, Slot> getPredEntry(int idx) const;
 
-  Entry<K, V> getSuccEntry(int idx) const;
+  Entry<K, Slot> getSuccEntry(int idx) const;
 
   void fillChild(int idx);
 
@@ -100,26 +240,51 @@ class BTreeNode {
 
   const std::vector<Entry<K, V>> getAllEntries() const;
 
+  int countLess(const K& key, bool inclusive) const;
+
+  const Entry<K, Slot>& select(int k) const;
+
+  typename Agg::Type aggregateRange(const K* lo, const K* hi) const;
+
+  bool validate(const K* lo, const K* hi, int depth, int& leafDepth,
+                bool isRoot) const;
+
   void printNodeInfo() const;
 
-  template <typename, typename>
+  template <typename, typename, typename>
   friend class BTree;
 };
 
-template <typename K, typename V>
+template <typename K, typename V, typename Agg = NoAggregate<V>>
 class BTree {
  private:
   int m_t;
-  std::shared_ptr<BTreeNode<K, V>> m_Root;
+  ValueStore<V> m_Store;
+  std::shared_ptr<BTreeNode<K, V, Agg>> m_Root;
 
  public:
+  // Writing through a value pointer would leave the aggregates stale, so
+  // with an aggregate policy values can only be changed by set()
+  using ValuePtr =
+      std::conditional_t<std::is_same_v<Agg, NoAggregate<V>>, V*, const V*>;
+
   explicit BTree(int t);
 
+  // Nodes point back to m_Store, a copied tree would share it
+  BTree(const BTree&) = delete;
+
+  BTree& operator=(const BTree&) = delete;
+
   ~BTree();
 
   void insert(const K& key, const V& value);
 
-  V* getValuePtr(const K& key);
+  // Values kept out of line keep their address until the key is removed,
+  // inline values move with their node's entries on every insert or remove
+  ValuePtr getValuePtr(const K& key);
+
+  // Read-only view of a value without copying it, same lifetime as above
+  const V* getValueView(const K& key) const;
 
   void set(const K& key, const V& value);
 
@@ -129,30 +294,85 @@ class BTree {
 
   std::vector<Entry<K, V>> getAllEntries() const;
 
+  int size() const;
+
+  // Number of keys strictly less than key
+  int rank(const K& key) const;
+
+  // The k-th smallest entry, 0-based
+  std::optional<Entry<K, V>> select(int k) const;
+
+  // Number of keys in [lo, hi]
+  int countRange(const K& lo, const K& hi) const;
+
+  // Agg::combine over the values of keys in [lo, hi], in key order
+  typename Agg::Type aggregateRange(const K& lo, const K& hi) const;
+
+  // Check B-tree invariants: key order, fill bounds, uniform leaf depth and
+  // the cached subtree counts and aggregates. Prints the first violation
+  bool validate() const;
+
   void printTreeInfo() const;
 
   void printAllEntries() const;
 };
 
-template <typename K, typename V>
-BTreeNode<K, V>::BTreeNode(int t, bool isLeaf) : m_t(t), m_isLeaf(isLeaf) {
+template <typename K, typename V, typename Agg>
+BTreeNode<K, V, Agg>::BTreeNode(int t, bool isLeaf, ValueStore<V>* store)
+    : m_t(t),
+      m_isLeaf(isLeaf),
+      m_Store(store),
+      m_Size(0),
+      m_Aggregate(Agg::identity()) {
   m_Entries.reserve(2 * t - 1);
   m_Children.reserve(2 * t);
 }
 
-template <typename K, typename V>
-int BTreeNode<K, V>::nEntries() const {
+template <typename K, typename V, typename Agg>
+int BTreeNode<K, V, Agg>::nEntries() const {
   return m_Entries.size();
 }
 
-template <typename K, typename V>
-int BTreeNode<K, V>::nChildren() const {
+template <typename K, typename V, typename Agg>
+int BTreeNode<K, V, Agg>::nChildren() const {
   return m_Children.size();
 }
 
-template <typename K, typename V>
-void BTreeNode<K, V>::insertToNonFull(const K& key, const V& value) {
-  cout << "inserting entry to NODE, key:" << key << ", value:" << value << endl;
+template <typename K, typename V, typename Agg>
+void BTreeNode<K, V, Agg>::updateAugment() {
+  m_Size = nEntries();
+  if (!m_isLeaf) {
+    for (int i = 0; i < nChildren(); i++)
+      m_Size += m_Children[i]->m_Size;
+  }
+
+  // Without an aggregate there is no need to touch the values at all
+  if constexpr (!std::is_same_v<Agg, NoAggregate<V>>) {
+    // Combine children and entries in key order: c0, e0, c1, e1, ..., cn
+    m_Aggregate = Agg::identity();
+    for (int i = 0; i < nEntries() + 1; i++) {
+      if (!m_isLeaf)
+        m_Aggregate = Agg::combine(m_Aggregate, m_Children[i]->m_Aggregate);
+      if (i < nEntries())
+        m_Aggregate = Agg::combine(
+            m_Aggregate, Agg::lift(m_Store->resolve(m_Entries[i].m_Value)));
+    }
+  }
+}
+
+// Recompute aggregates on the path to key after its value changed in place
+template <typename K, typename V, typename Agg>
+void BTreeNode<K, V, Agg>::refreshAugment(const K& key) {
+  int i = getIdxForKey(key);
+  if (!m_isLeaf && !(i < nEntries() && m_Entries[i].m_Key == key))
+    m_Children[i]->refreshAugment(key);
+  updateAugment();
+}
+
+template <typename K, typename V, typename Agg>
+void BTreeNode<K, V, Agg>::insertToNonFull(const K& key, const Slot& slot) {
+  cout << "inserting entry to NODE, key:" << key
+       << ", value:" << m_Store->resolve(slot) << endl;
   int i = nEntries() - 1;
 
   if (m_isLeaf) {
@@ -164,7 +384,7 @@ void BTreeNode<K, V>::insertToNonFull(const K& key, const V& value) {
     // 2. Insert new entry
     while (i >= 0 && m_Entries[i].m_Key > key)
       i--;
-    m_Entries.emplace(m_Entries.begin() + i + 1, key, value);
+    m_Entries.emplace(m_Entries.begin() + i + 1, key, slot);
   } else {
     // The current node is not leaf
     // Find the child which is going to have the new key
@@ -184,12 +404,13 @@ void BTreeNode<K, V>::insertToNonFull(const K& key, const V& value) {
         i++;
     }
     // Insert entry to proper child
-    m_Children[i + 1]->insertToNonFull(key, value);
+    m_Children[i + 1]->insertToNonFull(key, slot);
   }
+  updateAugment();
 }
 
-template <typename K, typename V>
-void BTreeNode<K, V>::splitChild(int fullChildIdx) {
+template <typename K, typename V, typename Agg>
+void BTreeNode<K, V, Agg>::splitChild(int fullChildIdx) {
   // fullChild will be split into 3 parts: t-1 keys, 1 key, t-1 keys
   // 1. The first t-1 keys remains in fullChild
   // 2. The last t-1 keys is put in a new split node
@@ -197,11 +418,11 @@ void BTreeNode<K, V>::splitChild(int fullChildIdx) {
   cout << "node full, splitting..." << endl;
 
   // Get a reference of the full child's pointer
-  std::shared_ptr<BTreeNode<K, V>>& fullChild = m_Children[fullChildIdx];
+  std::shared_ptr<BTreeNode<K, V, Agg>>& fullChild = m_Children[fullChildIdx];
 
   // Create a new child to store last (t-1) m_Keys
-  auto newChild =
-      std::make_shared<BTreeNode<K, V>>(fullChild->m_t, fullChild->m_isLeaf);
+  auto newChild = std::make_shared<BTreeNode<K, V, Agg>>(
+      fullChild->m_t, fullChild->m_isLeaf, fullChild->m_Store);
 
   // Copy last (t-1) entries starting from index [t] from fullChild to
   // newChild Then delete those entries from fullChild
@@ -225,18 +446,24 @@ void BTreeNode<K, V>::splitChild(int fullChildIdx) {
   m_Entries.insert(m_Entries.begin() + fullChildIdx,
                    fullChild->m_Entries[m_t - 1]);
   fullChild->m_Entries.erase(fullChild->m_Entries.begin() + m_t - 1);
+
+  // The parent keeps its size and aggregate, only the two halves change
+  fullChild->updateAugment();
+  newChild->updateAugment();
 }
 
-template <typename K, typename V>
-V* BTreeNode<K, V>::getValuePtr(const K& key) {
+template <typename K, typename V, typename Agg>
+typename BTreeNode<K, V, Agg>::Slot* BTreeNode<K, V, Agg>::getSlotPtr(
+    const K& key) {
   // Find first key >= given key
   int i = 0;
   while (i < nEntries() && key > m_Entries[i].m_Key)
     i++;
 
-  // Return value if found key. Need to check if i is still < m_nKeys
+  // Return slot if found key. Need to check if i is still < m_nKeys
   if (i < nEntries() && m_Entries[i].m_Key == key) {
-    cout << "found key: " << key << ", value: " << m_Entries[i].m_Value << endl;
+    cout << "found key: " << key
+         << ", value: " << m_Store->resolve(m_Entries[i].m_Value) << endl;
     return &(m_Entries[i].m_Value);
   }
 
@@ -247,11 +474,17 @@ V* BTreeNode<K, V>::getValuePtr(const K& key) {
   }
 
   // If key is not found, search in child
-  return m_Children[i]->getValuePtr(key);
+  return m_Children[i]->getSlotPtr(key);
 }
 
-template <typename K, typename V>
-int BTreeNode<K, V>::getIdxForKey(const K& key) const {
+template <typename K, typename V, typename Agg>
+V* BTreeNode<K, V, Agg>::getValuePtr(const K& key) {
+  Slot* slot = getSlotPtr(key);
+  return (slot == nullptr) ? nullptr : &(m_Store->resolve(*slot));
+}
+
+template <typename K, typename V, typename Agg>
+int BTreeNode<K, V, Agg>::getIdxForKey(const K& key) const {
   // Find first key >= given key
   int i = 0;
   while (i < nEntries() && key > m_Entries[i].m_Key)
@@ -259,8 +492,8 @@ int BTreeNode<K, V>::getIdxForKey(const K& key) const {
   return i;
 }
 
-template <typename K, typename V>
-void BTreeNode<K, V>::remove(const K& key) {
+template <typename K, typename V, typename Agg>
+void BTreeNode<K, V, Agg>::remove(const K& key) {
   cout << "removing from NODE, key:" << key << endl;
   int keyIdx = getIdxForKey(key);
 
@@ -272,6 +505,7 @@ void BTreeNode<K, V>::remove(const K& key) {
     else
       // This node is not a leaf node
       removeFromNonLeaf(keyIdx);
+    updateAugment();
     return;
   }
 
@@ -298,21 +532,22 @@ void BTreeNode<K, V>::remove(const K& key) {
     m_Children[keyIdx - 1]->remove(key);
   else
     m_Children[keyIdx]->remove(key);
+  updateAugment();
 }
 
-template <typename K, typename V>
-void BTreeNode<K, V>::removeFromLeaf(int idx) {
+template <typename K, typename V, typename Agg>
+void BTreeNode<K, V, Agg>::removeFromLeaf(int idx) {
   // Delete key and value pointer
   m_Entries.erase(m_Entries.begin() + idx);
 }
 
-template <typename K, typename V>
-void BTreeNode<K, V>::removeFromNonLeaf(int idx) {
+template <typename K, typename V, typename Agg>
+void BTreeNode<K, V, Agg>::removeFromNonLeaf(int idx) {
   if (m_Children[idx]->nEntries() >= m_t) {
     // If the child that holds key has at least t keys,
     // find the predecessor 'predKey' of key, replace key with predKey.
     // Recursively delete predKey from child idx
-    Entry<K, V> predEntry = getPredEntry(idx);
+    Entry<K, Slot> predEntry = getPredEntry(idx);
     m_Entries[idx] = predEntry;
     m_Children[idx]->remove(predEntry.m_Key);
   } else if (m_Children[idx + 1]->nEntries() >= m_t) {
@@ -320,23 +555,26 @@ void BTreeNode<K, V>::removeFromNonLeaf(int idx) {
     // If child idx+1 has at least t keys, find the successor 'succKey' of
     // key in child idx+1, replace key by succKey. Recursively delete
     // succKey from child idx+1
-    Entry<K, V> succEntry = getSuccEntry(idx);
+    Entry<K, Slot> succEntry = getSuccEntry(idx);
     m_Entries[idx] = succEntry;
     m_Children[idx + 1]->remove(succEntry.m_Key);
   } else {
     // If both children[idx] and children[idx+1] have less that t keys,
     // merge everything on children[idx+1] into children[idx].
     // Now children[idx] contains 2t-1 keys
-    // Free children[idx+1] and recursively delete key from children[idx]
+    // Free children[idx+1] and recursively delete key from children[idx].
+    // The merge pulls entries[idx] down, so keep its key beforehand
+    K key = m_Entries[idx].m_Key;
     mergeWithNextChild(idx);
-    m_Children[idx]->remove(m_Entries[idx].m_Key);
+    m_Children[idx]->remove(key);
   }
 }
 
-template <typename K, typename V>
-Entry<K, V> BTreeNode<K, V>::getPredEntry(int idx) const {
+template <typename K, typename V, typename Agg>
+Entry<K, typename BTreeNode<K, V, Agg>::Slot>
+BTreeNode<K, V, Agg>::getPredEntry(int idx) const {
   // Keep moving to the right most node until we reach a leaf
-  std::shared_ptr<BTreeNode<K, V>> cur = m_Children[idx];
+  std::shared_ptr<BTreeNode<K, V, Agg>> cur = m_Children[idx];
   while (!cur->m_isLeaf)
     cur = cur->m_Children[cur->nEntries()];
 
@@ -344,11 +582,12 @@ Entry<K, V> BTreeNode<K, V>::getPredEntry(int idx) const {
   return cur->m_Entries[cur->nEntries() - 1];
 }
 
-template <typename K, typename V>
-Entry<K, V> BTreeNode<K, V>::getSuccEntry(int idx) const {
+template <typename K, typename V, typename Agg>
+Entry<K, typename BTreeNode<K, V, Agg>::Slot>
+BTreeNode<K, V, Agg>::getSuccEntry(int idx) const {
   // Keep moving the left most node starting from children[idx+1] until we
   // reach a leaf
-  std::shared_ptr<BTreeNode<K, V>> cur = m_Children[idx + 1];
+  std::shared_ptr<BTreeNode<K, V, Agg>> cur = m_Children[idx + 1];
   while (!cur->m_isLeaf)
     cur = cur->m_Children[0];
 
@@ -357,8 +596,8 @@ Entry<K, V> BTreeNode<K, V>::getSuccEntry(int idx) const {
 }
 
 // Fill up the children[idx] if it has less than t-1 keys
-template <typename K, typename V>
-void BTreeNode<K, V>::fillChild(int idx) {
+template <typename K, typename V, typename Agg>
+void BTreeNode<K, V, Agg>::fillChild(int idx) {
   if (idx != 0 && m_Children[idx - 1]->nEntries() >= m_t)
     // If the previous child children[idx-1] has more than t-1 keys, borrow
     // a key from that child
@@ -379,32 +618,39 @@ void BTreeNode<K, V>::fillChild(int idx) {
 }
 
 // Borrow an entry from the children[idx-1] node and put it in children[idx]
-template <typename K, typename V>
-void BTreeNode<K, V>::borrowEntryFromPrevChild(int idx) {
-  std::shared_ptr<BTreeNode<K, V>> dest = m_Children[idx];
-  std::shared_ptr<BTreeNode<K, V>> prev = m_Children[idx - 1];
+template <typename K, typename V, typename Agg>
+void BTreeNode<K, V, Agg>::borrowEntryFromPrevChild(int idx) {
+  std::shared_ptr<BTreeNode<K, V, Agg>> dest = m_Children[idx];
+  std::shared_ptr<BTreeNode<K, V, Agg>> prev = m_Children[idx - 1];
 
   // The last key from children[idx-1] goes up to the parent and key[idx-1]
   // from parent is inserted as the first key in children[idx].
   dest->m_Entries.insert(dest->m_Entries.begin(), m_Entries[idx - 1]);
 
   // Moving prev child's last child as children[idx]'s first child
-  if (!dest->m_isLeaf)
+  if (!dest->m_isLeaf) {
     dest->m_Children.insert(dest->m_Children.begin(),
-                            prev->m_Children[prev->nEntries()]);
+                            prev->m_Children.back());
+    prev->m_Children.pop_back();
+  }
 
   // Moving the key from the prev child to the parent
-  // This reduces the number of keys in the prev child
-  m_Entries[idx - 1] = prev->m_Entries[prev->nEntries() - 1];
-  prev->remove(prev->m_Entries[prev->nEntries() - 1].m_Key);
+  // This reduces the number of keys in the prev child. Drop it directly,
+  // removing it by key from a non-leaf prev would pull a replacement up from
+  // the child that was just handed over to children[idx]
+  m_Entries[idx - 1] = prev->m_Entries.back();
+  prev->m_Entries.pop_back();
+
+  dest->updateAugment();
+  prev->updateAugment();
 }
 
 // A function to borrow an entry from the children[idx+1] and place it in
 // children[idx]
-template <typename K, typename V>
-void BTreeNode<K, V>::borrowEntryFromNextChild(int idx) {
-  std::shared_ptr<BTreeNode<K, V>> dest = m_Children[idx];
-  std::shared_ptr<BTreeNode<K, V>> next = m_Children[idx + 1];
+template <typename K, typename V, typename Agg>
+void BTreeNode<K, V, Agg>::borrowEntryFromNextChild(int idx) {
+  std::shared_ptr<BTreeNode<K, V, Agg>> dest = m_Children[idx];
+  std::shared_ptr<BTreeNode<K, V, Agg>> next = m_Children[idx + 1];
 
   // keys[idx] is inserted as the last key in children[idx]
   dest->m_Entries.push_back(m_Entries[idx]);
@@ -424,13 +670,16 @@ void BTreeNode<K, V>::borrowEntryFromNextChild(int idx) {
   if (!next->m_isLeaf) {
     next->m_Children.erase(next->m_Children.begin());
   }
+
+  dest->updateAugment();
+  next->updateAugment();
 }
 
 // Merge children[idx] and children[idx+1]
-template <typename K, typename V>
-void BTreeNode<K, V>::mergeWithNextChild(int idx) {
-  std::shared_ptr<BTreeNode<K, V>> child = m_Children[idx];
-  std::shared_ptr<BTreeNode<K, V>> next = m_Children[idx + 1];
+template <typename K, typename V, typename Agg>
+void BTreeNode<K, V, Agg>::mergeWithNextChild(int idx) {
+  std::shared_ptr<BTreeNode<K, V, Agg>> child = m_Children[idx];
+  std::shared_ptr<BTreeNode<K, V, Agg>> next = m_Children[idx + 1];
 
   // Pulling a key from the current node and inserting it into (t-1)th
   // position of children[idx]
@@ -450,29 +699,196 @@ void BTreeNode<K, V>::mergeWithNextChild(int idx) {
 
   // Moving the child pointers after (idx+1) in the current node forward by 1
   m_Children.erase(m_Children.begin() + idx + 1);
-}
 
-template <typename K, typename V>
-const std::vector<Entry<K, V>> BTreeNode<K, V>::getAllEntries() const {
-  if (m_isLeaf)
-    return m_Entries;
+  child->updateAugment();
+}
 
+template <typename K, typename V, typename Agg>
+const std::vector<Entry<K, V>> BTreeNode<K, V, Agg>::getAllEntries() const {
   std::vector<Entry<K, V>> res;
   for (int i = 0; i < nEntries() + 1; i++) {
     // Merge children[i] result, nEntries+1 children
-    std::vector<Entry<K, V>> childRes = m_Children[i]->getAllEntries();
-    res.insert(res.end(), childRes.begin(), childRes.end());
+    if (!m_isLeaf) {
+      std::vector<Entry<K, V>> childRes = m_Children[i]->getAllEntries();
+      res.insert(res.end(), std::make_move_iterator(childRes.begin()),
+                 std::make_move_iterator(childRes.end()));
+    }
 
-    // Merge entries[i], nEntries entries
+    // Merge entries[i], nEntries entries, values are fetched from the store
     if (i < nEntries())
-      res.push_back(m_Entries[i]);
+      res.emplace_back(m_Entries[i].m_Key,
+                       m_Store->resolve(m_Entries[i].m_Value));
   }
 
   return res;
 }
 
-template <typename K, typename V>
-void BTreeNode<K, V>::printNodeInfo() const {
+// Count keys < key, or keys <= key if inclusive, in this subtree
+template <typename K, typename V, typename Agg>
+int BTreeNode<K, V, Agg>::countLess(const K& key, bool inclusive) const {
+  int i = 0;
+  while (i < nEntries() && (inclusive ? !(m_Entries[i].m_Key > key)
+                                      : key > m_Entries[i].m_Key))
+    i++;
+
+  if (m_isLeaf)
+    return i;
+
+  // entries[0, i) and children[0, i) are all before key, children[i] may
+  // hold keys on both sides of it
+  int res = i;
+  for (int j = 0; j < i; j++)
+    res += m_Children[j]->m_Size;
+  return res + m_Children[i]->countLess(key, inclusive);
+}
+
+// Get the k-th smallest entry in this subtree, k must be in [0, m_Size)
+template <typename K, typename V, typename Agg>
+const Entry<K, typename BTreeNode<K, V, Agg>::Slot>&
+BTreeNode<K, V, Agg>::select(int k) const {
+  if (m_isLeaf)
+    return m_Entries[k];
+
+  // Skip whole children by their sizes, then the entry following each
+  for (int i = 0; i < nEntries(); i++) {
+    if (k < m_Children[i]->m_Size)
+      return m_Children[i]->select(k);
+    k -= m_Children[i]->m_Size;
+    if (k == 0)
+      return m_Entries[i];
+    k--;
+  }
+  return m_Children[nEntries()]->select(k);
+}
+
+// Aggregate values of keys in [*lo, *hi], a nullptr bound means the subtree
+// is known to be entirely on that side of it. Only the children straddling a
+// bound are descended into, others contribute their cached m_Aggregate
+template <typename K, typename V, typename Agg>
+typename Agg::Type BTreeNode<K, V, Agg>::aggregateRange(const K* lo,
+                                                       const K* hi) const {
+  if (lo == nullptr && hi == nullptr)
+    return m_Aggregate;
+
+  typename Agg::Type res = Agg::identity();
+  for (int i = 0; i < nEntries() + 1; i++) {
+    // children[i] holds keys between entries[i-1] and entries[i]
+    if (!m_isLeaf) {
+      bool endsBeforeLo = lo != nullptr && i < nEntries() &&
+                          *lo > m_Entries[i].m_Key;
+      bool startsAfterHi = hi != nullptr && i > 0 &&
+                           m_Entries[i - 1].m_Key > *hi;
+      if (!endsBeforeLo && !startsAfterHi) {
+        const K* childLo =
+            (i > 0 && lo != nullptr && !(*lo > m_Entries[i - 1].m_Key))
+                ? nullptr
+                : lo;
+        const K* childHi =
+            (i < nEntries() && hi != nullptr && !(m_Entries[i].m_Key > *hi))
+                ? nullptr
+                : hi;
+        res = Agg::combine(res,
+                           m_Children[i]->aggregateRange(childLo, childHi));
+      }
+    }
+
+    if (i < nEntries()) {
+      const K& key = m_Entries[i].m_Key;
+      if (hi != nullptr && key > *hi)
+        break;
+      if (lo == nullptr || !(*lo > key))
+        res = Agg::combine(res,
+                           Agg::lift(m_Store->resolve(m_Entries[i].m_Value)));
+    }
+  }
+  return res;
+}
+
+// Validate this subtree, all keys must be in (*lo, *hi) where a nullptr bound
+// is open. leafDepth is the depth of the first leaf seen, -1 before that
+template <typename K, typename V, typename Agg>
+bool BTreeNode<K, V, Agg>::validate(const K* lo, const K* hi, int depth,
+                                    int& leafDepth, bool isRoot) const {
+  // Every node but the root holds [t-1, 2t-1] entries, the root at least 1
+  int minEntries = isRoot ? 1 : m_t - 1;
+  if (nEntries() < minEntries || nEntries() > 2 * m_t - 1) {
+    cout << "invalid node: " << nEntries() << " entries, expected ["
+         << minEntries << ", " << 2 * m_t - 1 << "]" << endl;
+    return false;
+  }
+
+  // Keys are strictly sorted and strictly between the parent's separators,
+  // a duplicate key is a violation
+  for (int i = 0; i < nEntries(); i++) {
+    const K& key = m_Entries[i].m_Key;
+    if ((lo != nullptr && !(key > *lo)) || (hi != nullptr && !(*hi > key)) ||
+        (i > 0 && !(key > m_Entries[i - 1].m_Key))) {
+      cout << "invalid node: key " << key << " out of order" << endl;
+      return false;
+    }
+  }
+
+  if (m_isLeaf) {
+    if (nChildren() != 0) {
+      cout << "invalid leaf: has " << nChildren() << " children" << endl;
+      return false;
+    }
+    // All leaves are at the same depth
+    if (leafDepth == -1)
+      leafDepth = depth;
+    if (depth != leafDepth) {
+      cout << "invalid leaf: depth " << depth << ", expected " << leafDepth
+           << endl;
+      return false;
+    }
+  } else {
+    if (nChildren() != nEntries() + 1) {
+      cout << "invalid node: " << nChildren() << " children for "
+           << nEntries() << " entries" << endl;
+      return false;
+    }
+    // children[i] holds keys between entries[i-1] and entries[i]
+    for (int i = 0; i < nChildren(); i++) {
+      const K* childLo = (i > 0) ? &m_Entries[i - 1].m_Key : lo;
+      const K* childHi = (i < nEntries()) ? &m_Entries[i].m_Key : hi;
+      if (!m_Children[i]->validate(childLo, childHi, depth + 1, leafDepth,
+                                   false))
+        return false;
+    }
+  }
+
+  // Cached size and aggregate agree with a recomputation from children
+  int size = nEntries();
+  if (!m_isLeaf) {
+    for (int i = 0; i < nChildren(); i++)
+      size += m_Children[i]->m_Size;
+  }
+  if (size != m_Size) {
+    cout << "invalid node: stale subtree size " << m_Size << ", expected "
+         << size << endl;
+    return false;
+  }
+
+  if constexpr (!std::is_same_v<Agg, NoAggregate<V>>) {
+    typename Agg::Type aggregate = Agg::identity();
+    for (int i = 0; i < nEntries() + 1; i++) {
+      if (!m_isLeaf)
+        aggregate = Agg::combine(aggregate, m_Children[i]->m_Aggregate);
+      if (i < nEntries())
+        aggregate = Agg::combine(
+            aggregate, Agg::lift(m_Store->resolve(m_Entries[i].m_Value)));
+    }
+    if (!(aggregate == m_Aggregate)) {
+      cout << "invalid node: stale subtree aggregate" << endl;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+template <typename K, typename V, typename Agg>
+void BTreeNode<K, V, Agg>::printNodeInfo() const {
   if (m_Entries.empty())
     return;
 
@@ -480,8 +896,8 @@ void BTreeNode<K, V>::printNodeInfo() const {
   cout << "----" << (m_isLeaf ? "leaf " : "non-leaf") << "node with "
        << nEntries() << " key(s)----" << endl;
   for (int i = 0; i < nEntries(); i++) {
-    cout << "key: " << m_Entries[i].m_Key << ", value: " << m_Entries[i].m_Value
-         << endl;
+    cout << "key: " << m_Entries[i].m_Key
+         << ", value: " << m_Store->resolve(m_Entries[i].m_Value) << endl;
   }
 
   // Print keys, values on children
@@ -492,28 +908,30 @@ void BTreeNode<K, V>::printNodeInfo() const {
   }
 }
 
-template <typename K, typename V>
-BTree<K, V>::BTree(int t) : m_t(t), m_Root(nullptr) {}
+template <typename K, typename V, typename Agg>
+BTree<K, V, Agg>::BTree(int t) : m_t(t), m_Root(nullptr) {}
 
-template <typename K, typename V>
-BTree<K, V>::~BTree() {
+template <typename K, typename V, typename Agg>
+BTree<K, V, Agg>::~BTree() {
   cout << "deleting tree" << endl;
 }
 
-template <typename K, typename V>
-void BTree<K, V>::insert(const K& key, const V& value) {
+template <typename K, typename V, typename Agg>
+void BTree<K, V, Agg>::insert(const K& key, const V& value) {
   cout << "inserting entry to TREE, key:" << key << ", value:" << value << endl;
   if (m_Root == nullptr) {
     // Empty tree, init root
-    m_Root = std::make_shared<BTreeNode<K, V>>(m_t, true);
-    m_Root->m_Entries.template emplace_back(key, value);
+    m_Root = std::make_shared<BTreeNode<K, V, Agg>>(m_t, true, &m_Store);
+    m_Root->m_Entries.template emplace_back(key, m_Store.make(value));
+    m_Root->updateAugment();
   } else {
     // Non empty tree
     if (m_Root->nEntries() == 2 * m_t - 1) {
       cout << "ROOT full, splitting..." << endl;
 
       // Grow height if root full
-      auto newRoot = std::make_shared<BTreeNode<K, V>>(m_t, false);
+      auto newRoot =
+          std::make_shared<BTreeNode<K, V, Agg>>(m_t, false, &m_Store);
 
       // Make old root as child or new root
       newRoot->m_Children.push_back(m_Root);
@@ -526,56 +944,81 @@ void BTree<K, V>::insert(const K& key, const V& value) {
       int i = 0;
       if (key > newRoot->m_Entries[0].m_Key)
         i++;
-      newRoot->m_Children[i]->insertToNonFull(key, value);
+      newRoot->m_Children[i]->insertToNonFull(key, m_Store.make(value));
+      newRoot->updateAugment();
 
       // Take the new root
       m_Root = newRoot;
     } else {
       // Root not full, insert key, value to root
-      m_Root->insertToNonFull(key, value);
+      m_Root->insertToNonFull(key, m_Store.make(value));
     }
   }
 }
 
-template <typename K, typename V>
-V* BTree<K, V>::getValuePtr(const K& key) {
+template <typename K, typename V, typename Agg>
+typename BTree<K, V, Agg>::ValuePtr BTree<K, V, Agg>::getValuePtr(
+    const K& key) {
   return (m_Root == nullptr) ? nullptr : m_Root->getValuePtr(key);
 }
 
 template <typename K, typename V>
 const V getValue(const K& key) {}
 
-template <typename K, typename V>
-void BTree<K, V>::set(const K& key, const V& value) {
-  V* pCrtValue = getValuePtr(key);
+template <typename K, typename V, typename Agg>
+const V* BTree<K, V, Agg>::getValueView(const K& key) const {
+  return (m_Root == nullptr) ? nullptr : m_Root->getValuePtr(key);
+}
+
+template <typename K, typename V, typename Agg>
+void BTree<K, V, Agg>::set(const K& key, const V& value) {
+  V* pCrtValue = (m_Root == nullptr) ? nullptr : m_Root->getValuePtr(key);
   if (pCrtValue != nullptr) {
     // Copy the new value to memory address
     // May have performance hit, but copy value can maintain continuous
     // memory allocation for **values array
     *pCrtValue = value;
+
+    // The count is unchanged, but aggregates over the old value are stale
+    if constexpr (!std::is_same_v<Agg, NoAggregate<V>>)
+      m_Root->refreshAugment(key);
   } else {
     insert(key, value);
   }
 }
 
-template <typename K, typename V>
-std::optional<V> BTree<K, V>::get(const K& key) {
-  V* valuePtr = getValuePtr(key);
+template <typename K, typename V, typename Agg>
+std::optional<V> BTree<K, V, Agg>::get(const K& key) {
+  const V* valuePtr = getValuePtr(key);
   if (valuePtr == nullptr)
     return std::nullopt;
   return *(valuePtr);
 }
 
-template <typename K, typename V>
-void BTree<K, V>::remove(const K& key) {
+template <typename K, typename V, typename Agg>
+void BTree<K, V, Agg>::remove(const K& key) {
   cout << "removing from TREE, key:" << key << endl;
   if (m_Root == nullptr) {
     cout << "cannot remove key: " << key << ",the tree is empty";
     return;
   }
 
-  // Call the remove function for root
-  m_Root->remove(key);
+  if constexpr (isValueStoredOutOfLine<V>::value) {
+    // Keep the slot of the removed entry, restructuring while removing only
+    // moves slots around, so release the value after the entry is gone
+    typename BTreeNode<K, V, Agg>::Slot* pSlot = m_Root->getSlotPtr(key);
+    std::optional<typename BTreeNode<K, V, Agg>::Slot> slot;
+    if (pSlot != nullptr)
+      slot = *pSlot;
+
+    // Call the remove function for root
+    m_Root->remove(key);
+    if (slot.has_value())
+      m_Store.release(*slot);
+  } else {
+    // Inline values go away together with their entry
+    m_Root->remove(key);
+  }
 
   // If the root node has 0 keys, make its first child as the new root if it
   // has a child, otherwise set root as NULL
@@ -587,20 +1030,65 @@ void BTree<K, V>::remove(const K& key) {
   }
 }
 
-template <typename K, typename V>
-std::vector<Entry<K, V>> BTree<K, V>::getAllEntries() const {
+template <typename K, typename V, typename Agg>
+std::vector<Entry<K, V>> BTree<K, V, Agg>::getAllEntries() const {
+  if (m_Root == nullptr)
+    return {};
   return m_Root->getAllEntries();
 }
 
-template <typename K, typename V>
-void BTree<K, V>::printTreeInfo() const {
+template <typename K, typename V, typename Agg>
+int BTree<K, V, Agg>::size() const {
+  return (m_Root == nullptr) ? 0 : m_Root->m_Size;
+}
+
+template <typename K, typename V, typename Agg>
+int BTree<K, V, Agg>::rank(const K& key) const {
+  return (m_Root == nullptr) ? 0 : m_Root->countLess(key, false);
+}
+
+template <typename K, typename V, typename Agg>
+std::optional<Entry<K, V>> BTree<K, V, Agg>::select(int k) const {
+  if (k < 0 || k >= size())
+    return std::nullopt;
+  const Entry<K, typename BTreeNode<K, V, Agg>::Slot>& entry =
+      m_Root->select(k);
+  return Entry<K, V>(entry.m_Key, m_Store.resolve(entry.m_Value));
+}
+
+template <typename K, typename V, typename Agg>
+int BTree<K, V, Agg>::countRange(const K& lo, const K& hi) const {
+  if (m_Root == nullptr || lo > hi)
+    return 0;
+  return m_Root->countLess(hi, true) - m_Root->countLess(lo, false);
+}
+
+template <typename K, typename V, typename Agg>
+typename Agg::Type BTree<K, V, Agg>::aggregateRange(const K& lo,
+                                                   const K& hi) const {
+  if (m_Root == nullptr || lo > hi)
+    return Agg::identity();
+  return m_Root->aggregateRange(&lo, &hi);
+}
+
+template <typename K, typename V, typename Agg>
+bool BTree<K, V, Agg>::validate() const {
+  if (m_Root == nullptr)
+    return true;
+  int leafDepth = -1;
+  return m_Root->validate(nullptr, nullptr, 0, leafDepth, true);
+}
+
+template <typename K, typename V, typename Agg>
+void BTree<K, V, Agg>::printTreeInfo() const {
   cout << "\n----------tree info begins----------" << endl;
-  m_Root->printNodeInfo();
+  if (m_Root != nullptr)
+    m_Root->printNodeInfo();
   cout << "----------tree info ends----------\n" << endl;
 }
 
-template <typename K, typename V>
-void BTree<K, V>::printAllEntries() const {
+template <typename K, typename V, typename Agg>
+void BTree<K, V, Agg>::printAllEntries() const {
   std::vector<Entry<K, V>> entries = getAllEntries();
   cout << "\n----------all entries in tree begins----------" << endl;
   for (const Entry<K, V>& entry : entries) {
@@ -1,12 +1,20 @@
 #include <algorithm>  // for std::generate_n
 #include <chrono>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <random>
 
 #include "btree.h"
 
 #define TEST_COUNT 10000
 #define RDM_STR_LEN 3
+// Differential fuzzing against std::map, runs before the benchmark
+#define FUZZ_SEED 20240601
+#define FUZZ_OPS 20000
+#define FUZZ_KEY_RANGE 500
+#define FUZZ_VALIDATE_EVERY 100
 
 using std::cout;
 using std::endl;
@@ -20,6 +28,20 @@ using K = std::string;
 using V = std::vector<int>;
 // BTree degree t
 const int t = 5;
+// BTree degrees covered by the fuzzer
+const int fuzzDegrees[] = {2, 3, 4, 5, 7, 16};
+
+// Discard everything written to cout while in scope, the tree logs every
+// operation and the fuzzer runs far more of them than the benchmark
+class CoutSilencer {
+ public:
+  CoutSilencer() : m_Buf(cout.rdbuf(nullptr)) {}
+
+  ~CoutSilencer() { cout.rdbuf(m_Buf); }
+
+ private:
+  std::streambuf* m_Buf;
+};
 
 // Generate random string of given length from given char set
 std::string genRandomStr(size_t length) {
@@ -55,7 +77,144 @@ void readTest(BTree<K, V>& btree) {
   }
 }
 
+void genFuzzValue(std::mt19937& rng, int& value) {
+  value = rng() % 1000;
+}
+
+void genFuzzValue(std::mt19937& rng, std::vector<int>& value) {
+  // Draw in a fixed order, argument evaluation order is unspecified
+  int length = 1 + rng() % 8;
+  int element = rng() % 1000;
+  value.assign(length, element);
+}
+
+// Run a seeded random mix of insert/set/remove/get on a tree of degree
+// fuzzT and on a std::map, checking both agree and the tree stays valid
+template <typename FV, typename Agg = NoAggregate<FV>>
+bool fuzzTest(int fuzzT, unsigned seed) {
+  std::mt19937 rng(seed);
+  BTree<int, FV, Agg> btree(fuzzT);
+  std::map<int, FV> model;
+
+  auto fail = [&](int op, const char* what) {
+    cout << "fuzz failed: t=" << fuzzT << ", seed=" << seed << ", op=" << op
+         << ": " << what << endl;
+    return false;
+  };
+
+  for (int op = 0; op < FUZZ_OPS; op++) {
+    int key = rng() % FUZZ_KEY_RANGE;
+    FV value;
+    genFuzzValue(rng, value);
+
+    bool valid = true;
+    std::optional<FV> got;
+    {
+      CoutSilencer silencer;
+      switch (rng() % 4) {
+        case 0:
+          // insert() does not check for duplicates, only use it for new keys
+          if (model.count(key) == 0)
+            btree.insert(key, value);
+          else
+            btree.set(key, value);
+          model[key] = value;
+          break;
+        case 1:
+          btree.set(key, value);
+          model[key] = value;
+          break;
+        case 2:
+          btree.remove(key);
+          model.erase(key);
+          break;
+        default:
+          got = btree.get(key);
+          auto it = model.find(key);
+          if (got.has_value() != (it != model.end()) ||
+              (got.has_value() && !(*got == it->second)))
+            valid = false;
+          break;
+      }
+    }
+    if (!valid)
+      return fail(op, "get() differs from std::map");
+
+    if (op % FUZZ_VALIDATE_EVERY != 0)
+      continue;
+
+    {
+      CoutSilencer silencer;
+      valid = btree.validate();
+    }
+    if (!valid) {
+      // Validate again with output on to print the violation
+      btree.validate();
+      return fail(op, "invariants broken");
+    }
+
+    if (btree.size() != (int)model.size())
+      return fail(op, "size() differs from std::map");
+
+    // Order statistics against the model
+    int lo = rng() % FUZZ_KEY_RANGE;
+    int hi = lo + rng() % (FUZZ_KEY_RANGE / 4);
+    auto loIt = model.lower_bound(lo);
+    auto hiIt = model.upper_bound(hi);
+    if (btree.rank(lo) != std::distance(model.begin(), loIt))
+      return fail(op, "rank() differs from std::map");
+    if (btree.countRange(lo, hi) != std::distance(loIt, hiIt))
+      return fail(op, "countRange() differs from std::map");
+    if (!model.empty()) {
+      int k = rng() % model.size();
+      std::optional<Entry<int, FV>> selected = btree.select(k);
+      auto it = std::next(model.begin(), k);
+      if (!selected.has_value() || selected->m_Key != it->first ||
+          !(selected->m_Value == it->second))
+        return fail(op, "select() differs from std::map");
+    }
+    if constexpr (!std::is_same_v<Agg, NoAggregate<FV>>) {
+      typename Agg::Type expected = Agg::identity();
+      for (auto it = loIt; it != hiIt; ++it)
+        expected = Agg::combine(expected, Agg::lift(it->second));
+      if (!(btree.aggregateRange(lo, hi) == expected))
+        return fail(op, "aggregateRange() differs from std::map");
+    }
+  }
+
+  // Final full comparison of the tree contents
+  std::vector<Entry<int, FV>> entries = btree.getAllEntries();
+  if (entries.size() != model.size() ||
+      !std::equal(entries.begin(), entries.end(), model.begin(),
+                  [](const Entry<int, FV>& entry, const auto& kv) {
+                    return entry.m_Key == kv.first &&
+                           entry.m_Value == kv.second;
+                  }))
+    return fail(FUZZ_OPS, "getAllEntries() differs from std::map");
+
+  return true;
+}
+
+bool fuzzTests() {
+  unsigned seed = FUZZ_SEED;
+  for (int fuzzT : fuzzDegrees) {
+    // Inline values with each aggregate, and out of line values
+    if (!fuzzTest<int, SumAggregate<int>>(fuzzT, seed++) ||
+        !fuzzTest<int, MinAggregate<int>>(fuzzT, seed++) ||
+        !fuzzTest<int, MaxAggregate<int>>(fuzzT, seed++) ||
+        !fuzzTest<std::vector<int>>(fuzzT, seed++))
+      return false;
+  }
+  cout << "fuzz passed: " << FUZZ_OPS << " ops for each of "
+       << std::size(fuzzDegrees) << " degrees" << endl;
+  return true;
+}
+
 int main() {
+  // Timings only count for a tree that behaves like std::map
+  if (!fuzzTests())
+    return 1;
+
   srand(time(nullptr));
 
   auto* btree = new BTree<K, V>(t);
@@ -79,6 +238,13 @@ int main() {
   auto readEllapsed =
       std::chrono::duration_cast<std::chrono::nanoseconds>(readEnd - writeEnd);
 
+  // Check invariants at full scale after the timed runs
+  if (!btree->validate()) {
+    cout << "btree invariants broken after stress test" << endl;
+    delete btree;
+    return 1;
+  }
+
   cout << endl
        << TEST_COUNT << " KVs, execution time:" << endl
        << "  write: " << writeEllapsed.count() * 1e-9 << " seconds" << endl